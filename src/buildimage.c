@@ -20,13 +20,36 @@
 #define BUFFER_SIZE 200 					/* error buffer size in bytes */
 #define BOOTBLOCK_IMAGE_OFFSET 0 
 #define KERNEL_IMAGE_OFFSET SECTOR_SIZE
-#define BOOTLOADER_KERNEL_SECTORS_OFFSET 2
+#define BOOTLOADER_KERNEL_SECTORS_OFFSET 2	/* os_size field: 4 bytes, read as a word by the bootblock */
+#define BOOTLOADER_KERNEL_LOAD_ADDR 0x1000	/* linear address the bootblock loads the kernel to (es = 0x100) */
+#define BOOTLOADER_STACK_SEGMENT 0x9000		/* ss set by the bootblock, the kernel must end below it */
+/* Sectors the bootblock can load before the kernel reaches its stack. Its CHS loop 
+ * addresses up to 2880 floppy sectors, so the stack is the tighter limit. */
+#define BOOTLOADER_MAX_LEGACY_SECTORS ((BOOTLOADER_STACK_SEGMENT * 16 - BOOTLOADER_KERNEL_LOAD_ADDR) / SECTOR_SIZE)
+#define MBR_DISK_SIGNATURE_OFFSET 0x1b8		/* disk signature, followed by the partition table at 0x1be */
+#define KERNEL_MAX_EXTENTS 2				/* entries in the kernel descriptor extent table */
+#define KERNEL_DESCRIPTOR_SIZE (WORD_SIZE + 2 * HALF_WORD_SIZE + KERNEL_MAX_EXTENTS * 2 * WORD_SIZE)
+#define KERNEL_DESCRIPTOR_OFFSET (MBR_DISK_SIGNATURE_OFFSET - KERNEL_DESCRIPTOR_SIZE) /* kept out of the MBR */
 #define TRUE 1
 #define FALSE 0
 
 #define bootblock_arg(ARGC) ((ARGC) - 2) /* Function-like Macro to calculate bootblock filename index in argv */
 #define kernel_arg(ARGC) ((ARGC) - 1) 	 /* Function-like Macro to calculate kernel filename index in argv */
 
+/* Contiguous run of kernel sectors on disk */
+typedef struct 
+{
+	uint32_t lba;	/* first sector of the run */
+	uint32_t count; /* number of sectors in the run */
+} Kernel_Extent;
+
+/* Kernel descriptor recorded in the boot sector */
+typedef struct 
+{
+	uint32_t num_sectors;
+	uint16_t num_extents;
+	Kernel_Extent extents[KERNEL_MAX_EXTENTS];
+} Kernel_Descriptor;
 
 char error_buffer[BUFFER_SIZE]; 
 int architecture_bit_width = 4; 	/* 4 bytes = 32 Bit Architecture */
@@ -508,6 +531,28 @@ void write_kernel(FILE **imagefile, FILE *kernelfile, Elf32_Ehdr *kernel_header,
 	free(program_buffer);
 }
 
+/*
+ * Function:  segments_size
+ * --------------------
+ * Sums the memory size of all segments of a program header
+ * 
+ *  program_header
+ *  _phnum: number of program headers
+ * 
+ *  returns: number of bytes the segments take in the image
+ */
+uint32_t segments_size(Elf32_Phdr *program_header, int _phnum)
+{
+	uint32_t sum_memsz = 0;
+
+	for (int i = 0; i < _phnum; i++)
+	{
+		sum_memsz += program_header[i].p_memsz;
+	}
+
+	return sum_memsz;
+}
+
 /*
  * Function:  count_kernel_sectors
  * --------------------
@@ -520,14 +565,9 @@ void write_kernel(FILE **imagefile, FILE *kernelfile, Elf32_Ehdr *kernel_header,
  */
 int count_kernel_sectors(Elf32_Ehdr *kernel_header, Elf32_Phdr *kernel_phdr)
 {	
-	uint32_t sum_memsz = 0;
+	uint32_t sum_memsz = segments_size(kernel_phdr, kernel_header->e_phnum);
 	uint32_t num_sectors;
 
-	for (int i = 0; i < kernel_header->e_phnum; i++)
-	{
-		sum_memsz += kernel_phdr[i].p_memsz;
-	}
-
 	num_sectors = sum_memsz / SECTOR_SIZE;
 
 	if (sum_memsz % SECTOR_SIZE) 
@@ -536,21 +576,59 @@ int count_kernel_sectors(Elf32_Ehdr *kernel_header, Elf32_Phdr *kernel_phdr)
 	return num_sectors;
 }
 
+/*
+ * Function:  build_kernel_descriptor
+ * --------------------
+ * Fills the kernel descriptor for a kernel written contiguously after the bootblock
+ * 	
+ * 	descriptor: kernel descriptor to be filled
+ * 	num_sec: number of kernel sectors
+ */
+void build_kernel_descriptor(Kernel_Descriptor *descriptor, int num_sec)
+{
+	memset(descriptor, 0, sizeof(Kernel_Descriptor));
+	descriptor->num_sectors = (uint32_t) num_sec;
+	descriptor->num_extents = 1;
+	descriptor->extents[0].lba = KERNEL_IMAGE_OFFSET / SECTOR_SIZE;
+	descriptor->extents[0].count = (uint32_t) num_sec;
+}
+
 /*
  * Function:  record_kernel_sectors
  * --------------------
- * Records the number of sectors in the kernel
+ * Records the number of sectors in the kernel and the kernel descriptor.
+ * The descriptor lives at KERNEL_DESCRIPTOR_OFFSET, before the MBR disk
+ * signature and partition table, and has the layout (all fields little-endian):
+ *
+ *		uint32_t num_sectors;		total kernel sectors
+ *		uint16_t num_extents;		used entries in the extent table
+ *		uint16_t reserved;
+ *		struct { uint32_t lba; uint32_t count; } extents[KERNEL_MAX_EXTENTS];
+ *
+ *  so a bootloader can load each extent with a few int 0x13 AH=42h reads.
  * 	
  * 	imagefile
- *  kernel_header: kernel elf header
- *  kernel_phdr: kernel program header
- * 	num_sec: number of kernel sectors
+ * 	descriptor: kernel descriptor to be recorded
  */
-void record_kernel_sectors(FILE **imagefile, Elf32_Ehdr *kernel_header, Elf32_Phdr *kernel_phdr, int num_sec)
+void record_kernel_sectors(FILE **imagefile, Kernel_Descriptor *descriptor)
 {
 	unsigned char magic_number[2] = {0x55, 0xAA};
+	uint16_t reserved = 0;
+
 	fseek(*imagefile, BOOTLOADER_KERNEL_SECTORS_OFFSET, SEEK_SET);
-	fwrite(&num_sec, 1, 1, *imagefile);
+	fwrite(&(descriptor->num_sectors), WORD_SIZE, 1, *imagefile);
+
+	// Write the kernel descriptor and its extent table
+	fseek(*imagefile, KERNEL_DESCRIPTOR_OFFSET, SEEK_SET);
+	fwrite(&(descriptor->num_sectors), WORD_SIZE, 1, *imagefile);
+	fwrite(&(descriptor->num_extents), HALF_WORD_SIZE, 1, *imagefile);
+	fwrite(&reserved, HALF_WORD_SIZE, 1, *imagefile);
+	for (int i = 0; i < KERNEL_MAX_EXTENTS; i++)
+	{
+		fwrite(&(descriptor->extents[i].lba), WORD_SIZE, 1, *imagefile);
+		fwrite(&(descriptor->extents[i].count), WORD_SIZE, 1, *imagefile);
+	}
+
 	// Write magic Number
 	fseek(*imagefile, BOOTLOADER_SIG_OFFSET, SEEK_SET);
 	fwrite(magic_number, 2, 1, *imagefile);
@@ -588,10 +666,13 @@ void print_segments_info(Elf32_Phdr *program_header, int _phnum, int is_kernel)
  * 	bph: bootfile program header
  *  k_phnum: kernel number of program headers
  *  kph: kernelfile program header
- *  num_sec: number of kernel sectors
+ *  descriptor: kernel descriptor recorded in the image
  */
-void extended_opt(Elf32_Phdr *bph, int k_phnum, Elf32_Phdr *kph, int num_sec)
+void extended_opt(Elf32_Phdr *bph, int k_phnum, Elf32_Phdr *kph, Kernel_Descriptor *descriptor)
 {
+	int num_sec = descriptor->num_sectors;
+
+
 	/* print number of disk sectors used by the image */
 	printf("disk_sectors: %d\n", num_sec + 1);
 
@@ -605,64 +686,101 @@ void extended_opt(Elf32_Phdr *bph, int k_phnum, Elf32_Phdr *kph, int num_sec)
 
 	/* print kernel size in sectors */
 	printf("os_size: %d sectors\n", num_sec);
+
+	/* print kernel descriptor extent table */
+	for (int i = 0; i < descriptor->num_extents; i++)
+	{
+		printf("kernel_extent: lba %u, %u sectors\n", descriptor->extents[i].lba, descriptor->extents[i].count);
+	}
 }
 
 /* MAIN */
 // ignore the --vm argument when implementing (project 1)
 int main(int argc, char **argv)
 {
-	FILE *kernelfile, *bootfile, *imagefile;				//file pointers for bootblock,kernel and image
+	FILE *kernelfile = NULL, *bootfile = NULL, *imagefile = NULL; //file pointers for bootblock,kernel and image
 	Elf32_Ehdr *boot_header = malloc(sizeof(Elf32_Ehdr));   //bootblock ELF header
 	Elf32_Ehdr *kernel_header = malloc(sizeof(Elf32_Ehdr)); //kernel ELF header
 
-	Elf32_Phdr *boot_program_header;   //bootblock ELF program header
-	Elf32_Phdr *kernel_program_header; //kernel ELF program header
+	Elf32_Phdr *boot_program_header = NULL;   //bootblock ELF program header
+	Elf32_Phdr *kernel_program_header = NULL; //kernel ELF program header
 	
+	Kernel_Descriptor kernel_descriptor; // kernel sectors and extents recorded in the image
+	uint32_t bootblock_size; // bytes written by the bootblock segments
 	int num_sectors; // number of kernel sectors
+	int status = 1;
 
 	//TODO: change this for the second project
 	/* check if the args were used correctly */
 	if (argc < 3 || argc > 4) 
 	{
 		fprintf(stderr, "Usage: %s %s \n", argv[0], ARGS);
-		return 1;
+		goto cleanup;
 	}
-	
-	/* build image file */
-	handle_file_open(&imagefile, "wb", IMAGE_FILE);
 
 	/* read executable bootblock file */
 	boot_program_header = read_exec_file(&bootfile, argv[bootblock_arg(argc)], &boot_header);
-	
-	/* write bootblock */
-	write_bootblock(&imagefile, bootfile, boot_header, boot_program_header);
+	if (boot_program_header == NULL)
+		goto cleanup;
+
+	/* the bootblock code must not overlap the kernel descriptor */
+	bootblock_size = segments_size(boot_program_header, boot_header->e_phnum);
+	if (bootblock_size > KERNEL_DESCRIPTOR_OFFSET)
+	{
+		fprintf(stderr, "Bootblock too large: 0x%04x bytes overlap the kernel descriptor at 0x%04x\n", 
+			bootblock_size, KERNEL_DESCRIPTOR_OFFSET);
+		goto cleanup;
+	}
 
 	/* read executable kernel file */
 	kernel_program_header = read_exec_file(&kernelfile, argv[kernel_arg(argc)], &kernel_header);
+	if (kernel_program_header == NULL)
+		goto cleanup;
+
+	/* the bootblock must be able to load the whole kernel */
+	num_sectors = count_kernel_sectors(kernel_header, kernel_program_header);
+	if (num_sectors > BOOTLOADER_MAX_LEGACY_SECTORS)
+	{
+		fprintf(stderr, "Kernel too large: %d sectors, the bootblock can load at most %d\n", 
+			num_sectors, BOOTLOADER_MAX_LEGACY_SECTORS);
+		goto cleanup;
+	}
+	build_kernel_descriptor(&kernel_descriptor, num_sectors);
+
+	/* build image file */
+	if (handle_file_open(&imagefile, "wb", IMAGE_FILE) == -1)
+		goto cleanup;
+
+	/* write bootblock */
+	write_bootblock(&imagefile, bootfile, boot_header, boot_program_header);
 
 	/* write kernel segments to image */
 	write_kernel(&imagefile, kernelfile, kernel_header, kernel_program_header);
 
-	num_sectors = count_kernel_sectors(kernel_header, kernel_program_header);
 	/* tell the bootloader how many sectors to read to load the kernel */
-	record_kernel_sectors(&imagefile, kernel_header, kernel_program_header, num_sectors);
+	record_kernel_sectors(&imagefile, &kernel_descriptor);
 
 	/* check for  --extended option */
 	if (!strncmp(argv[1], "--extended", 11))
 	{
 		/* print info */
-		extended_opt(boot_program_header, kernel_header->e_phnum, kernel_program_header, num_sectors);
+		extended_opt(boot_program_header, kernel_header->e_phnum, kernel_program_header, &kernel_descriptor);
 	} 
 
-	fclose(imagefile);
-	fclose(bootfile);
-	fclose(kernelfile);
+	status = 0;
+
+cleanup:
+	if (imagefile != NULL)
+		fclose(imagefile);
+	if (bootfile != NULL)
+		fclose(bootfile);
+	if (kernelfile != NULL)
+		fclose(kernelfile);
 
 	free(boot_header);
 	free(kernel_header);
 	free(kernel_program_header);
 	free(boot_program_header);
 	
-	return 0;
+	return status;
 } // ends main()
-